@@ -14,6 +14,9 @@ typedef void (*hs_iter_func)(void *key, void *value);
 
 typedef void (*hs_const_iter_func)(const void *key, const void *value);
 
+typedef bool (*hs_predicate_func)(const void *key, const void *value,
+                                  void *context);
+
 /**
  * Opaque data structure representing the map.
  * Should only be accessed using the functions declared below.
@@ -43,11 +46,38 @@ hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
                                       hs_unary_func key_remove_notify,
                                       hs_unary_func value_remove_notify);
 
+/**
+ * Creates new instance of fixed-capacity hash map suitable for use as a cache.
+ * The map never grows: when there is no room for a new key, an entry from
+ * the key's neighbourhood is evicted using the CLOCK (second chance) policy,
+ * with a separate clock hand for every neighbourhood.
+ * Entries are marked as referenced whenever they are overwritten or retrieved;
+ * new entries start unreferenced, so entries that are never read again are
+ * evicted first. Evicted entries are reported through the remove notify functions.
+ * Since retrieval updates the reference bits, reading a bounded map modifies
+ * it, and concurrent reads must be synchronized like writes.
+ * Note that eviction may happen before the map holds max_size entries if the
+ * neighbourhood of the key is saturated.
+ *
+ * @param hash_func Key hash function.
+ * @param equal_func Function for testing keys for equality.
+ * @param key_remove_notify Function called when key is removed from map.
+ * @param value_remove_notify Function called when value is removed from map.
+ * @param max_size Maximum number of entries; must be greater than zero.
+ * @return  Pointer to created map.
+ */
+hs_hash_map *hs_hash_map_new_bounded(hs_hash_func hash_func,
+                                     hs_equal_func equal_func,
+                                     hs_unary_func key_remove_notify,
+                                     hs_unary_func value_remove_notify,
+                                     size_t max_size);
+
 /**
  * Adds the corresponding key-value pair to the map.
  * If the key already exists, overwrites the value.
  * Note that key can be NULL if provided hash and comparison
  * functions are NULL-safe.
+ * Bounded maps evict an existing entry instead of growing.
  *
  * @param map Target map.
  * @param key Key pointer.
@@ -56,6 +86,29 @@ hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
  */
 bool hs_hash_map_put(hs_hash_map *map, void *key, void *value);
 
+/**
+ * Creates a copy of the map with the same capacity and layout.
+ * The copy shares key and value pointers with the original map and therefore
+ * does not inherit its remove notify functions.
+ *
+ * @param map Map to copy.
+ * @return Pointer to created map, NULL on failure.
+ */
+hs_hash_map *hs_hash_map_clone(const hs_hash_map *map);
+
+/**
+ * Adds all the key-value pairs of src to dst, overwriting values of
+ * existing keys. Storage of dst is grown once up front to fit the result,
+ * unless dst is bounded, in which case entries are evicted instead.
+ * Afterwards dst shares key and value pointers with src, so if both maps have
+ * remove notify functions, freeing both notifies shared entries twice.
+ *
+ * @param dst Target map.
+ * @param src Map to copy entries from.
+ * @return true on success, false otherwise.
+ */
+bool hs_hash_map_merge(hs_hash_map *dst, const hs_hash_map *src);
+
 /**
  * Retrieves value by key.
  * Note that if you use NULL values, it is impossible to distinguish them from
@@ -69,6 +122,8 @@ void *hs_hash_map_get(hs_hash_map *map, const void *key);
 
 /**
  * Const version of hs_hash_map_get().
+ * Note that for bounded maps it still updates the entry's reference bit,
+ * so it is not safe to call concurrently on the same map.
  *
  * @param map Target map.
  * @param key Key pointer.
@@ -84,6 +139,25 @@ const void *hs_hash_map_get_const(const hs_hash_map *map, const void *key);
  */
 void hs_hash_map_remove(hs_hash_map *map, const void *key);
 
+/**
+ * Removes all the key-value pairs matching the predicate in a single pass.
+ * The predicate must not modify the map.
+ *
+ * @param map Target map.
+ * @param predicate Function returning true for entries to remove.
+ * @param context Pointer passed to the predicate as is.
+ * @return Number of removed entries.
+ */
+size_t hs_hash_map_remove_if(hs_hash_map *map, hs_predicate_func predicate,
+                             void *context);
+
+/**
+ * Removes all the key-value pairs, keeping the allocated storage.
+ *
+ * @param map Target map.
+ */
+void hs_hash_map_clear(hs_hash_map *map);
+
 /**
  * Copies all the keys to specified location.
  *
@@ -5,13 +5,36 @@
 #include <stdint.h>
 
 #define HS_HASH_MAP_INITIAL_CAPACITY 32
+// Maximum load factor (in percent) a map is grown to before bulk insertion
+#define HS_HASH_MAP_PRESIZE_LOAD 75
+
+// Neighbourhood width, can be overridden at compile time
+#ifndef HS_HASH_MAP_VIRTUAL_BUCKET_SIZE
 #define HS_HASH_MAP_VIRTUAL_BUCKET_SIZE 32
+#endif
 
+#if HS_HASH_MAP_VIRTUAL_BUCKET_SIZE == 8
+typedef uint8_t hs_bitmap;
+#elif HS_HASH_MAP_VIRTUAL_BUCKET_SIZE == 16
+typedef uint16_t hs_bitmap;
+#elif HS_HASH_MAP_VIRTUAL_BUCKET_SIZE == 32
 typedef uint32_t hs_bitmap;
+#elif HS_HASH_MAP_VIRTUAL_BUCKET_SIZE == 64
+typedef uint64_t hs_bitmap;
+#else
+#error "HS_HASH_MAP_VIRTUAL_BUCKET_SIZE must be 8, 16, 32 or 64"
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
 
 typedef struct {
         hs_bitmap hop_info;
         bool has_value;
+        bool referenced;
+        // CLOCK hand of the neighbourhood starting at this bucket
+        uint8_t clock_hand;
         void *key;
         void *value;
 } hs_hash_map_bucket;
@@ -23,24 +46,53 @@ struct _hs_hash_map {
         hs_unary_func value_remove_notify;
         size_t size;
         size_t capacity;
+        bool bounded;
         hs_hash_map_bucket *buckets;
 };
 
 static inline void hs_hash_map_set_bit(hs_bitmap *bitmap, unsigned position)
 {
-        *bitmap |= (1 << (HS_HASH_MAP_VIRTUAL_BUCKET_SIZE - 1 - position));
+        *bitmap |= (hs_bitmap) ((hs_bitmap) 1 << position);
 }
 
 static inline void hs_hash_map_clear_bit(hs_bitmap *bitmap, unsigned position)
 {
-        *bitmap &= ~((uint32_t) (1 << (HS_HASH_MAP_VIRTUAL_BUCKET_SIZE -
-                                       1 - position)));
+        *bitmap &= (hs_bitmap) ~((hs_bitmap) 1 << position);
+}
+
+// Returns position of the lowest set bit; bitmap must be non-zero
+static inline unsigned hs_hash_map_first_bit(hs_bitmap bitmap)
+{
+#if defined(__GNUC__) || defined(__clang__)
+        return (unsigned) __builtin_ctzll(bitmap);
+#elif defined(_MSC_VER) && defined(_WIN64)
+        unsigned long position;
+        _BitScanForward64(&position, bitmap);
+        return (unsigned) position;
+#elif defined(_MSC_VER) && HS_HASH_MAP_VIRTUAL_BUCKET_SIZE <= 32
+        unsigned long position;
+        _BitScanForward(&position, bitmap);
+        return (unsigned) position;
+#elif defined(_MSC_VER)
+        unsigned long position;
+        if (_BitScanForward(&position, (unsigned long) bitmap))
+                return (unsigned) position;
+        _BitScanForward(&position, (unsigned long) (bitmap >> 32));
+        return (unsigned) position + 32;
+#else
+        unsigned position = 0;
+        while (!(bitmap & 1)) {
+                bitmap >>= 1;
+                ++position;
+        }
+        return position;
+#endif
 }
 
-static bool hs_hash_map_get_bit(const hs_bitmap *bitmap, unsigned position)
+// Returns bitmap with bits [0, count) set; count must be less than bitmap width
+static inline hs_bitmap hs_hash_map_low_bits(size_t count)
 {
-        return (*bitmap &
-                (1 << (HS_HASH_MAP_VIRTUAL_BUCKET_SIZE - 1 - position))) != 0;
+        return (hs_bitmap) (((hs_bitmap) 1 << count) - 1);
 }
 
 static inline void hs_hash_map_put_to_bucket(hs_hash_map *map,
@@ -50,6 +102,7 @@ static inline void hs_hash_map_put_to_bucket(hs_hash_map *map,
         bucket->key = key;
         bucket->value = value;
         bucket->has_value = true;
+        bucket->referenced = false;
         ++map->size;
 }
 
@@ -67,6 +120,9 @@ static void hs_hash_map_swap_bucket_contents(hs_hash_map_bucket *first,
         temp_value = first->has_value;
         first->has_value = second->has_value;
         second->has_value = temp_value;
+        temp_value = first->referenced;
+        first->referenced = second->referenced;
+        second->referenced = temp_value;
 }
 
 static hs_hash_map_bucket *hs_hash_map_find_bucket_extended(
@@ -76,23 +132,20 @@ static hs_hash_map_bucket *hs_hash_map_find_bucket_extended(
         size_t *initial_index,
         size_t *index_offset)
 {
-        hs_hash_map_bucket *start_bucket = map->buckets + index;
-        hs_hash_map_bucket *bucket = NULL;
-        size_t offset = 0;
-        do {
-                while (offset < HS_HASH_MAP_VIRTUAL_BUCKET_SIZE &&
-                       !hs_hash_map_get_bit(&start_bucket->hop_info,
-                                            (unsigned) offset))
-                        ++offset;
-                if (offset == HS_HASH_MAP_VIRTUAL_BUCKET_SIZE)
-                        return NULL;
-                bucket = map->buckets + index + offset++;
-        } while (!map->equal_func(bucket->key, key));
-        if (initial_index)
-                *initial_index = index;
-        if (index_offset)
-                *index_offset = offset - 1;
-        return bucket;
+        hs_bitmap hop_info = map->buckets[index].hop_info;
+        while (hop_info) {
+                unsigned offset = hs_hash_map_first_bit(hop_info);
+                hs_hash_map_bucket *bucket = map->buckets + index + offset;
+                if (map->equal_func(bucket->key, key)) {
+                        if (initial_index)
+                                *initial_index = index;
+                        if (index_offset)
+                                *index_offset = offset;
+                        return bucket;
+                }
+                hop_info &= (hs_bitmap) (hop_info - 1);
+        }
+        return NULL;
 }
 
 static hs_hash_map_bucket *hs_hash_map_find_bucket(const hs_hash_map *map,
@@ -112,44 +165,53 @@ static bool hs_hash_map_put_internal(hs_hash_map *map, void *key, void *value)
         if (bucket) {
                 void *old_value = bucket->value;
                 bucket->value = value;
+                bucket->referenced = true;
                 if (map->value_remove_notify)
                         map->value_remove_notify(old_value);
                 return true;
         }
 
         size_t index = start_index;
+        size_t last_index = map->capacity - 1;
+        // Bounded maps stay full once they fill up, so their search is limited
+        // to the target neighbourhood and the caller evicts if it has no room
+        if (map->bounded &&
+            last_index - start_index >= HS_HASH_MAP_VIRTUAL_BUCKET_SIZE)
+                last_index = start_index + HS_HASH_MAP_VIRTUAL_BUCKET_SIZE - 1;
         hs_hash_map_bucket *start_bucket = bucket = map->buckets + index;
-        while (bucket->has_value && index < (map->capacity - 1))
+        while (bucket->has_value && index < last_index)
                 bucket = map->buckets + (++index);
         if (bucket->has_value)
                 return false;
         hs_hash_map_bucket *empty_bucket = bucket;
         size_t empty_index = index;
         while (empty_index - start_index >= HS_HASH_MAP_VIRTUAL_BUCKET_SIZE) {
+                bool moved = false;
                 index = empty_index + 1 - HS_HASH_MAP_VIRTUAL_BUCKET_SIZE;
-                while (index < empty_index) {
-                        bucket = map->buckets + index;
-                        size_t initial = map->hash_func(bucket->key) %
-                                         map->capacity;
-                        if (empty_index - initial >=
-                            HS_HASH_MAP_VIRTUAL_BUCKET_SIZE) {
-                                ++index;
+                for (; index < empty_index && !moved; ++index) {
+                        hs_hash_map_bucket *initial_bucket =
+                                map->buckets + index;
+                        // Entries of this neighbourhood that can be moved to
+                        // the empty bucket without leaving the neighbourhood
+                        hs_bitmap candidates =
+                                initial_bucket->hop_info &
+                                hs_hash_map_low_bits(empty_index - index);
+                        if (!candidates)
                                 continue;
-                        }
+                        unsigned offset = hs_hash_map_first_bit(candidates);
+                        bucket = initial_bucket + offset;
                         hs_hash_map_swap_bucket_contents(bucket, empty_bucket);
-                        hs_hash_map_bucket *initial_bucket =
-                                map->buckets + initial;
                         hs_hash_map_clear_bit(&initial_bucket->hop_info,
-                                              (unsigned) (index - initial));
+                                              offset);
                         hs_hash_map_set_bit(&initial_bucket->hop_info,
-                                            (unsigned) (empty_index - initial));
-                        empty_index = index++;
+                                            (unsigned) (empty_index - index));
+                        empty_index = index + offset;
                         empty_bucket = bucket;
-                        break;
+                        moved = true;
                 }
                 // No suitable empty buckets were found in the neighbourhood of
                 // the target bucket
-                if (index == empty_index)
+                if (!moved)
                         return false;
         }
         hs_hash_map_set_bit(&start_bucket->hop_info,
@@ -163,10 +225,57 @@ void *hs_hash_map_get_internal(const hs_hash_map *map, const void *key)
         hs_hash_map_bucket *bucket = hs_hash_map_find_bucket(map, key);
         if (!bucket)
                 return NULL;
+        if (map->bounded && !bucket->referenced)
+                bucket->referenced = true;
         return bucket->value;
 }
 
-static bool hs_hash_map_rehash(hs_hash_map *map)
+static hs_hash_map_bucket *hs_hash_map_evict(hs_hash_map *map,
+                                             size_t start_index)
+{
+        hs_hash_map_bucket *start_bucket = map->buckets + start_index;
+        size_t count = map->capacity - start_index;
+        if (count > HS_HASH_MAP_VIRTUAL_BUCKET_SIZE)
+                count = HS_HASH_MAP_VIRTUAL_BUCKET_SIZE;
+        hs_hash_map_bucket *bucket;
+        size_t index;
+        // Only called when the neighbourhood has no empty buckets; the hand
+        // stops within two turns since the first one clears all reference bits
+        for (;;) {
+                index = start_index + start_bucket->clock_hand;
+                bucket = map->buckets + index;
+                start_bucket->clock_hand =
+                        (uint8_t) ((start_bucket->clock_hand + 1) % count);
+                if (!bucket->referenced)
+                        break;
+                bucket->referenced = false;
+        }
+        size_t initial = map->hash_func(bucket->key) % map->capacity;
+        hs_hash_map_clear_bit(&map->buckets[initial].hop_info,
+                              (unsigned) (index - initial));
+        bucket->has_value = false;
+        --map->size;
+        if (map->key_remove_notify)
+                map->key_remove_notify(bucket->key);
+        if (map->value_remove_notify)
+                map->value_remove_notify(bucket->value);
+        return bucket;
+}
+
+static bool hs_hash_map_put_evicting(hs_hash_map *map, void *key, void *value)
+{
+        if (hs_hash_map_put_internal(map, key, value))
+                return true;
+        // The key is not present and its neighbourhood is full
+        size_t start_index = map->hash_func(key) % map->capacity;
+        hs_hash_map_bucket *bucket = hs_hash_map_evict(map, start_index);
+        hs_hash_map_set_bit(&map->buckets[start_index].hop_info,
+                            (unsigned) (bucket - map->buckets - start_index));
+        hs_hash_map_put_to_bucket(map, bucket, key, value);
+        return true;
+}
+
+static bool hs_hash_map_resize(hs_hash_map *map, size_t capacity)
 {
         // Triggered when collision is encountered during rehash
         bool bad_rehash;
@@ -178,12 +287,12 @@ static bool hs_hash_map_rehash(hs_hash_map *map)
         temp->equal_func = map->equal_func;
         temp->key_remove_notify = NULL;
         temp->value_remove_notify = NULL;
-        temp->capacity = map->capacity;
+        temp->capacity = capacity;
+        temp->bounded = false;
         temp->buckets = NULL;
         do {
                 bad_rehash = false;
                 free(temp->buckets);
-                temp->capacity = temp->capacity * 2;
                 temp->buckets = calloc(temp->capacity,
                                        sizeof(hs_hash_map_bucket));
                 if (!temp->buckets) {
@@ -198,6 +307,8 @@ static bool hs_hash_map_rehash(hs_hash_map *map)
                                                                bucket->key,
                                                                bucket->value);
                 }
+                if (bad_rehash)
+                        temp->capacity = temp->capacity * 2;
         } while (bad_rehash);
         map->capacity = temp->capacity;
         free(map->buckets);
@@ -206,15 +317,36 @@ static bool hs_hash_map_rehash(hs_hash_map *map)
         return true;
 }
 
+static bool hs_hash_map_rehash(hs_hash_map *map)
+{
+        return hs_hash_map_resize(map, map->capacity * 2);
+}
+
+static void hs_hash_map_notify_all(hs_hash_map *map)
+{
+        if (!map->key_remove_notify && !map->value_remove_notify)
+                return;
+        for (size_t i = 0; i < map->capacity; ++i) {
+                hs_hash_map_bucket *bucket = map->buckets + i;
+                if (!bucket->has_value)
+                        continue;
+                if (map->key_remove_notify)
+                        map->key_remove_notify(bucket->key);
+                if (map->value_remove_notify)
+                        map->value_remove_notify(bucket->value);
+        }
+}
+
 hs_hash_map *hs_hash_map_new(hs_hash_func hash_func, hs_equal_func equal_func)
 {
         return hs_hash_map_new_extended(hash_func, equal_func, NULL, NULL);
 }
 
-hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
-                                      hs_equal_func equal_func,
-                                      hs_unary_func key_remove_notify,
-                                      hs_unary_func value_remove_notify)
+static hs_hash_map *hs_hash_map_new_internal(hs_hash_func hash_func,
+                                             hs_equal_func equal_func,
+                                             hs_unary_func key_remove_notify,
+                                             hs_unary_func value_remove_notify,
+                                             size_t capacity, bool bounded)
 {
         hs_hash_map *map = malloc(sizeof(hs_hash_map));
         if (!map)
@@ -224,7 +356,8 @@ hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
         map->key_remove_notify = key_remove_notify;
         map->value_remove_notify = value_remove_notify;
         map->size = 0;
-        map->capacity = HS_HASH_MAP_INITIAL_CAPACITY;
+        map->capacity = capacity;
+        map->bounded = bounded;
         map->buckets = calloc(map->capacity, sizeof(hs_hash_map_bucket));
         if (!map->buckets) {
                 free(map);
@@ -233,8 +366,33 @@ hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
         return map;
 }
 
+hs_hash_map *hs_hash_map_new_extended(hs_hash_func hash_func,
+                                      hs_equal_func equal_func,
+                                      hs_unary_func key_remove_notify,
+                                      hs_unary_func value_remove_notify)
+{
+        return hs_hash_map_new_internal(hash_func, equal_func,
+                                        key_remove_notify, value_remove_notify,
+                                        HS_HASH_MAP_INITIAL_CAPACITY, false);
+}
+
+hs_hash_map *hs_hash_map_new_bounded(hs_hash_func hash_func,
+                                     hs_equal_func equal_func,
+                                     hs_unary_func key_remove_notify,
+                                     hs_unary_func value_remove_notify,
+                                     size_t max_size)
+{
+        if (max_size == 0)
+                return NULL;
+        return hs_hash_map_new_internal(hash_func, equal_func,
+                                        key_remove_notify, value_remove_notify,
+                                        max_size, true);
+}
+
 bool hs_hash_map_put(hs_hash_map *map, void *key, void *value)
 {
+        if (map->bounded)
+                return hs_hash_map_put_evicting(map, key, value);
         while (!hs_hash_map_put_internal(map, key, value)) {
                 if (!hs_hash_map_rehash(map))
                         return false;
@@ -243,6 +401,50 @@ bool hs_hash_map_put(hs_hash_map *map, void *key, void *value)
 
 }
 
+hs_hash_map *hs_hash_map_clone(const hs_hash_map *map)
+{
+        hs_hash_map *clone = malloc(sizeof(hs_hash_map));
+        if (!clone)
+                return NULL;
+        *clone = *map;
+        clone->key_remove_notify = NULL;
+        clone->value_remove_notify = NULL;
+        clone->buckets = malloc(map->capacity * sizeof(hs_hash_map_bucket));
+        if (!clone->buckets) {
+                free(clone);
+                return NULL;
+        }
+        memcpy(clone->buckets, map->buckets,
+               map->capacity * sizeof(hs_hash_map_bucket));
+        return clone;
+}
+
+bool hs_hash_map_merge(hs_hash_map *dst, const hs_hash_map *src)
+{
+        if (dst == src)
+                return true;
+        if (!dst->bounded) {
+                size_t capacity = dst->capacity;
+                size_t max_size = dst->size + src->size;
+                while (capacity * HS_HASH_MAP_PRESIZE_LOAD / 100 < max_size)
+                        capacity *= 2;
+                if (capacity != dst->capacity &&
+                    !hs_hash_map_resize(dst, capacity))
+                        return false;
+        }
+        for (size_t i = 0; i < src->capacity; ++i) {
+                hs_hash_map_bucket *bucket = src->buckets + i;
+                if (!bucket->has_value)
+                        continue;
+                if (!dst->bounded &&
+                    hs_hash_map_put_internal(dst, bucket->key, bucket->value))
+                        continue;
+                if (!hs_hash_map_put(dst, bucket->key, bucket->value))
+                        return false;
+        }
+        return true;
+}
+
 void *hs_hash_map_get(hs_hash_map *map, const void *key)
 {
         return hs_hash_map_get_internal(map, key);
@@ -272,6 +474,41 @@ void hs_hash_map_remove(hs_hash_map *map, const void *key)
         }
 }
 
+size_t hs_hash_map_remove_if(hs_hash_map *map, hs_predicate_func predicate,
+                             void *context)
+{
+        size_t removed = 0;
+        // Every entry is reachable from exactly one bit of its initial bucket,
+        // so walking the bitmaps visits each entry once without rehashing keys
+        for (size_t i = 0; i < map->capacity; ++i) {
+                hs_hash_map_bucket *initial = map->buckets + i;
+                hs_bitmap hop_info = initial->hop_info;
+                while (hop_info) {
+                        unsigned offset = hs_hash_map_first_bit(hop_info);
+                        hop_info &= (hs_bitmap) (hop_info - 1);
+                        hs_hash_map_bucket *bucket = initial + offset;
+                        if (!predicate(bucket->key, bucket->value, context))
+                                continue;
+                        hs_hash_map_clear_bit(&initial->hop_info, offset);
+                        bucket->has_value = false;
+                        ++removed;
+                        if (map->key_remove_notify)
+                                map->key_remove_notify(bucket->key);
+                        if (map->value_remove_notify)
+                                map->value_remove_notify(bucket->value);
+                }
+        }
+        map->size -= removed;
+        return removed;
+}
+
+void hs_hash_map_clear(hs_hash_map *map)
+{
+        hs_hash_map_notify_all(map);
+        memset(map->buckets, 0, map->capacity * sizeof(hs_hash_map_bucket));
+        map->size = 0;
+}
+
 void hs_hash_map_get_keys(const hs_hash_map *map, void *dst[])
 {
         size_t i = 0;
@@ -345,17 +582,7 @@ void hs_hash_map_for_each_const(const hs_hash_map *map,
 
 void hs_hash_map_free(hs_hash_map *map)
 {
-        if (map->key_remove_notify || map->value_remove_notify) {
-                for (size_t i = 0; i < map->capacity; ++i) {
-                        hs_hash_map_bucket *bucket = map->buckets + i;
-                        if (!bucket->has_value)
-                                continue;
-                        if (map->key_remove_notify)
-                                map->key_remove_notify(bucket->key);
-                        if (map->value_remove_notify)
-                                map->value_remove_notify(bucket->value);
-                }
-        }
+        hs_hash_map_notify_all(map);
         free(map->buckets);
         free(map);
 }
@@ -7,6 +7,7 @@
 
 char string_keys[4096 * 32];
 char string_values[4096 * 32];
+size_t removed_count = 0;
 
 size_t djb_hash(const void *data)
 {
@@ -27,6 +28,19 @@ void bool_free_func(void *data)
         *((bool *) data) = true;
 }
 
+void count_free_func(void *data)
+{
+        (void) data;
+        ++removed_count;
+}
+
+bool key_in_range_func(const void *key, const void *value, void *context)
+{
+        (void) value;
+        const char *end = (const char *) context;
+        return (const char *) key < end;
+}
+
 void read_lines(const char *file_name, int max_length, char *out)
 {
         FILE *file = fopen(file_name, "r");
@@ -182,4 +196,183 @@ int main()
                 hs_hash_map_free(map);
         }
 
+        /*
+         * Bounded map eviction
+         */
+        {
+                size_t n = 4096;
+                size_t max_size = 256;
+                removed_count = 0;
+                hs_hash_map *map = hs_hash_map_new_bounded(djb_hash,
+                                                           string_equal_func,
+                                                           NULL,
+                                                           count_free_func,
+                                                           max_size);
+                for (size_t i = 0; i < n; ++i) {
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                        assert(hs_hash_map_size(map) <= max_size);
+                        assert(hs_hash_map_get(map, string_keys + i * 32) ==
+                               string_values + i * 32);
+                }
+                // Was remove handler called for every evicted value?
+                assert(removed_count == n - hs_hash_map_size(map));
+                size_t present = 0;
+                for (size_t i = 0; i < n; ++i)
+                        if (hs_hash_map_has_key(map, string_keys + i * 32))
+                                ++present;
+                assert(present == hs_hash_map_size(map));
+                hs_hash_map_free(map);
+                assert(removed_count == n);
+        }
+
+        /*
+         * Puts into a full bounded map
+         */
+        {
+                size_t n = 4096;
+                size_t max_size = 2048;
+                removed_count = 0;
+                hs_hash_map *map = hs_hash_map_new_bounded(djb_hash,
+                                                           string_equal_func,
+                                                           count_free_func,
+                                                           NULL, max_size);
+                for (size_t pass = 0; pass < 8; ++pass) {
+                        for (size_t i = 0; i < n; ++i) {
+                                char *key = string_keys + i * 32;
+                                bool is_new = !hs_hash_map_has_key(map, key);
+                                size_t size = hs_hash_map_size(map);
+                                size_t removed = removed_count;
+                                hs_hash_map_put(map, key,
+                                                string_values + i * 32);
+                                assert(hs_hash_map_load_factor(map) <= 1);
+                                // Evicting puts must not change the size
+                                if (removed_count != removed)
+                                        assert(hs_hash_map_size(map) == size);
+                                else
+                                        assert(hs_hash_map_size(map) ==
+                                               size + is_new);
+                        }
+                }
+                assert(removed_count > 0);
+                hs_hash_map_free(map);
+        }
+
+        /*
+         * Bounded map keeps recently read entries
+         */
+        {
+                size_t n = 4096;
+                char *hot_key = string_keys;
+                hs_hash_map *map = hs_hash_map_new_bounded(djb_hash,
+                                                           string_equal_func,
+                                                           NULL, NULL, 64);
+                hs_hash_map_put(map, hot_key, string_values);
+                for (size_t i = 1; i < n; ++i) {
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                        assert(hs_hash_map_get(map, hot_key) == string_values);
+                }
+                hs_hash_map_free(map);
+        }
+
+        /*
+         * Map cloning
+         */
+        {
+                hs_hash_map *map = hs_hash_map_new(djb_hash, string_equal_func);
+                size_t n = 1024;
+                for (size_t i = 0; i < n; ++i)
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                hs_hash_map *clone = hs_hash_map_clone(map);
+                assert(hs_hash_map_size(clone) == n);
+                for (size_t i = 0; i < n; ++i)
+                        assert(hs_hash_map_get(clone, string_keys + i * 32) ==
+                               string_values + i * 32);
+                // Changes to the clone must not affect the original
+                hs_hash_map_remove(clone, string_keys);
+                assert(!hs_hash_map_has_key(clone, string_keys));
+                assert(hs_hash_map_has_key(map, string_keys));
+                hs_hash_map_free(clone);
+                hs_hash_map_free(map);
+        }
+
+        /*
+         * Map merging
+         */
+        {
+                hs_hash_map *dst = hs_hash_map_new(djb_hash, string_equal_func);
+                hs_hash_map *src = hs_hash_map_new(djb_hash, string_equal_func);
+                size_t n = 4096;
+                for (size_t i = 0; i < n / 2; ++i)
+                        hs_hash_map_put(dst, string_keys + i * 32,
+                                        string_values);
+                for (size_t i = n / 4; i < n; ++i)
+                        hs_hash_map_put(src, string_keys + i * 32,
+                                        string_values + i * 32);
+                assert(hs_hash_map_merge(dst, src));
+                assert(hs_hash_map_size(dst) == n);
+                assert(hs_hash_map_size(src) == n - n / 4);
+                for (size_t i = 0; i < n / 4; ++i)
+                        assert(hs_hash_map_get(dst, string_keys + i * 32) ==
+                               string_values);
+                for (size_t i = n / 4; i < n; ++i)
+                        assert(hs_hash_map_get(dst, string_keys + i * 32) ==
+                               string_values + i * 32);
+                hs_hash_map_free(src);
+                hs_hash_map_free(dst);
+        }
+
+        /*
+         * Conditional removal
+         */
+        {
+                size_t n = 2048;
+                removed_count = 0;
+                hs_hash_map *map = hs_hash_map_new_extended(djb_hash,
+                                                            string_equal_func,
+                                                            NULL,
+                                                            count_free_func);
+                for (size_t i = 0; i < n; ++i)
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                size_t removed = hs_hash_map_remove_if(map, key_in_range_func,
+                                                       string_keys + n / 2 * 32);
+                assert(removed == n / 2);
+                assert(removed_count == n / 2);
+                assert(hs_hash_map_size(map) == n - n / 2);
+                for (size_t i = 0; i < n; ++i)
+                        assert(hs_hash_map_has_key(map, string_keys + i * 32) ==
+                               (i >= n / 2));
+                // Removed entries must leave the map usable for insertion
+                for (size_t i = 0; i < n / 2; ++i)
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                assert(hs_hash_map_size(map) == n);
+                hs_hash_map_free(map);
+        }
+
+        /*
+         * Map clearing
+         */
+        {
+                size_t n = 1024;
+                removed_count = 0;
+                hs_hash_map *map = hs_hash_map_new_extended(djb_hash,
+                                                            string_equal_func,
+                                                            NULL,
+                                                            count_free_func);
+                for (size_t i = 0; i < n; ++i)
+                        hs_hash_map_put(map, string_keys + i * 32,
+                                        string_values + i * 32);
+                hs_hash_map_clear(map);
+                assert(removed_count == n);
+                assert(hs_hash_map_is_empty(map));
+                assert(!hs_hash_map_has_key(map, string_keys));
+                hs_hash_map_put(map, string_keys, string_values);
+                assert(hs_hash_map_get(map, string_keys) == string_values);
+                hs_hash_map_free(map);
+        }
+
 }